@@ -0,0 +1,179 @@
+#ifndef BN_FIXED_H
+#define BN_FIXED_H
+
+/*
+ * Fully unrolled kernels for operands of a fixed number of limbs.
+ *
+ * Each bn_*_fixed() template is instantiated once per limb count from 1 to
+ * BN_FIXED_LIMBS, so every loop below has a constant trip count and is
+ * unrolled by the compiler. bn_fixed_*() pick the kernel for n limbs.
+ *
+ *   add: c[0..n) = a[0..n) + b[0..n), return the carry out
+ *   sub: c[0..n) = a[0..n) - b[0..n), return the borrow out
+ *   mul: c[0..2n) = a[0..n) * b[0..n)
+ *   sqr: c[0..2n) = a[0..n) * a[0..n)
+ */
+static __always_inline unsigned int bn_add_fixed(unsigned int *c,
+                                                 const unsigned int *a,
+                                                 const unsigned int *b,
+                                                 const unsigned int n)
+{
+    unsigned long long carry = 0;
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n; i++) {
+        carry += (unsigned long long) a[i] + b[i];
+        c[i] = carry;
+        carry >>= 32;
+    }
+    return carry;
+}
+
+static __always_inline unsigned int bn_sub_fixed(unsigned int *c,
+                                                 const unsigned int *a,
+                                                 const unsigned int *b,
+                                                 const unsigned int n)
+{
+    unsigned int borrow = 0;
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned long long diff = (unsigned long long) a[i] - b[i] - borrow;
+        c[i] = diff;
+        borrow = (diff >> 32) & 1;
+    }
+    return borrow;
+}
+
+static __always_inline void bn_mul_fixed(unsigned int *c,
+                                         const unsigned int *a,
+                                         const unsigned int *b,
+                                         const unsigned int n)
+{
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n; i++)
+        c[i] = 0;
+
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned long long carry = 0;
+#pragma GCC unroll 16
+        for (unsigned int j = 0; j < n; j++) {
+            carry += (unsigned long long) a[i] * b[j] + c[i + j];
+            c[i + j] = carry;
+            carry >>= 32;
+        }
+        c[i + n] = carry;
+    }
+}
+
+static __always_inline void bn_sqr_fixed(unsigned int *c,
+                                         const unsigned int *a,
+                                         const unsigned int n)
+{
+#pragma GCC unroll 32
+    for (unsigned int i = 0; i < 2 * n; i++)
+        c[i] = 0;
+
+    // cross products a[i] * a[j], i < j, each computed once
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned long long carry = 0;
+#pragma GCC unroll 16
+        for (unsigned int j = i + 1; j < n; j++) {
+            carry += (unsigned long long) a[i] * a[j] + c[i + j];
+            c[i + j] = carry;
+            carry >>= 32;
+        }
+        c[i + n] = carry;
+    }
+
+    // double them
+    unsigned int bit = 0;
+#pragma GCC unroll 32
+    for (unsigned int i = 0; i < 2 * n; i++) {
+        unsigned int top = c[i] >> 31;
+        c[i] = c[i] << 1 | bit;
+        bit = top;
+    }
+
+    // and add the squares a[i] * a[i]
+    unsigned long long carry = 0;
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned long long sq = (unsigned long long) a[i] * a[i];
+        carry += (unsigned long long) c[2 * i] + (unsigned int) sq;
+        c[2 * i] = carry;
+        carry >>= 32;
+        carry += (unsigned long long) c[2 * i + 1] + (sq >> 32);
+        c[2 * i + 1] = carry;
+        carry >>= 32;
+    }
+}
+
+/*
+ * Dispatch on the limb count with a switch over the inlined instantiations
+ * rather than a table of function pointers, so there is no indirect call
+ * (and no retpoline) in front of these short kernels.
+ */
+#define BN_FIXED_FOR_EACH(X)                                                  \
+    X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13)      \
+        X(14) X(15) X(16)
+
+static inline unsigned int bn_fixed_add(unsigned int *c,
+                                        const unsigned int *a,
+                                        const unsigned int *b,
+                                        unsigned int n)
+{
+    switch (n) {
+#define BN_FIXED_CASE(k) \
+    case k:              \
+        return bn_add_fixed(c, a, b, k);
+        BN_FIXED_FOR_EACH(BN_FIXED_CASE)
+#undef BN_FIXED_CASE
+    }
+    return 0;
+}
+
+static inline unsigned int bn_fixed_sub(unsigned int *c,
+                                        const unsigned int *a,
+                                        const unsigned int *b,
+                                        unsigned int n)
+{
+    switch (n) {
+#define BN_FIXED_CASE(k) \
+    case k:              \
+        return bn_sub_fixed(c, a, b, k);
+        BN_FIXED_FOR_EACH(BN_FIXED_CASE)
+#undef BN_FIXED_CASE
+    }
+    return 0;
+}
+
+static inline void bn_fixed_mul(unsigned int *c,
+                                const unsigned int *a,
+                                const unsigned int *b,
+                                unsigned int n)
+{
+    switch (n) {
+#define BN_FIXED_CASE(k)         \
+    case k:                      \
+        bn_mul_fixed(c, a, b, k); \
+        break;
+        BN_FIXED_FOR_EACH(BN_FIXED_CASE)
+#undef BN_FIXED_CASE
+    }
+}
+
+static inline void bn_fixed_sqr(unsigned int *c,
+                                const unsigned int *a,
+                                unsigned int n)
+{
+    switch (n) {
+#define BN_FIXED_CASE(k)      \
+    case k:                   \
+        bn_sqr_fixed(c, a, k); \
+        break;
+        BN_FIXED_FOR_EACH(BN_FIXED_CASE)
+#undef BN_FIXED_CASE
+    }
+}
+#endif
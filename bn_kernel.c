@@ -1,7 +1,20 @@
+#include <linux/jump_label.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#endif
 
 #include "bn_kernel.h"
+#include "bn_fixed.h"
+
+/* operands of at most this many limbs use the unrolled bn_fixed kernels */
+unsigned int bn_fixed_max = BN_FIXED_LIMBS;
 
 static int bn_clz(const bn *src)
 {
@@ -17,11 +30,6 @@ static int bn_clz(const bn *src)
     return cnt;
 }
 
-static int bn_msb(const bn *src)
-{
-    return src->size * 32 - bn_clz(src);
-}
-
 int bn_free(bn *src)
 {
     if (src == NULL)
@@ -77,26 +85,314 @@ int bn_cpy(bn *dest, bn *src)
 }
 
 
-/* |c| = |a| + |b| */
-static void bn_do_add(const bn *a, const bn *b, bn *c)
+/*
+ * limb kernels
+ *
+ * c[0..n) = a[0..n) + b[0..n), return the carry out
+ * c[0..n) = a[0..n) - b[0..n), return the borrow out
+ * c[0..n) += a[0..n) * b,      return the carry limb
+ *
+ * The generic versions are plain C. On x86-64 CPUs with ADX and BMI2 the
+ * same operations run on pairs of limbs as 64-bit words, with MULX feeding
+ * two independent carry chains (ADCX on CF, ADOX on OF) in the multiply
+ * row. bn_kernel_init() picks the implementation once at module load.
+ */
+static unsigned int bn_add_limbs_generic(unsigned int *c,
+                                         const unsigned int *a,
+                                         const unsigned int *b,
+                                         unsigned int n)
 {
-    // max digits = max(sizeof(a) + sizeof(b)) + 1
-    int d = MAX(bn_msb(a), bn_msb(b)) + 1;
-    d = DIV_ROUNDUP(d, 32) + !d;
-    bn_resize(c, d);
+    unsigned long long carry = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        carry += (unsigned long long) a[i] + b[i];
+        c[i] = carry;
+        carry >>= 32;
+    }
+    return carry;
+}
+
+static unsigned int bn_sub_limbs_generic(unsigned int *c,
+                                         const unsigned int *a,
+                                         const unsigned int *b,
+                                         unsigned int n)
+{
+    unsigned int borrow = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned long long diff = (unsigned long long) a[i] - b[i] - borrow;
+        c[i] = diff;
+        borrow = (diff >> 32) & 1;
+    }
+    return borrow;
+}
 
+static unsigned int bn_addmul_limbs_generic(unsigned int *c,
+                                            const unsigned int *a,
+                                            unsigned int n,
+                                            unsigned int b)
+{
     unsigned long long carry = 0;
-    for (int i = 0; i < c->size; i++) {
-        unsigned int tmp1 = (i < a->size) ? a->number[i] : 0;
-        unsigned int tmp2 = (i < b->size) ? b->number[i] : 0;
+    for (unsigned int i = 0; i < n; i++) {
+        carry += (unsigned long long) a[i] * b + c[i];
+        c[i] = carry;
+        carry >>= 32;
+    }
+    return carry;
+}
+
+#ifdef CONFIG_X86_64
+static DEFINE_STATIC_KEY_FALSE(bn_use_adx);
+
+static unsigned int bn_add_limbs_adx(unsigned int *c,
+                                     const unsigned int *a,
+                                     const unsigned int *b,
+                                     unsigned int n)
+{
+    unsigned long words = n >> 1, tmp;
+    unsigned char cf = 0;
+
+    if (words) {
+        asm volatile(
+            "xor %k[tmp], %k[tmp]\n\t" /* clear CF */
+            "1:\n\t"
+            "movq (%[a]), %[tmp]\n\t"
+            "adcx (%[b]), %[tmp]\n\t"
+            "movq %[tmp], (%[c])\n\t"
+            "leaq 8(%[a]), %[a]\n\t"
+            "leaq 8(%[b]), %[b]\n\t"
+            "leaq 8(%[c]), %[c]\n\t"
+            "dec %[n]\n\t" /* preserves CF */
+            "jnz 1b\n\t"
+            "setc %[cf]\n\t"
+            : [a] "+r"(a), [b] "+r"(b), [c] "+r"(c), [n] "+r"(words),
+              [tmp] "=&r"(tmp), [cf] "=q"(cf)
+            :
+            : "cc", "memory");
+    }
+
+    if (n & 1) {
+        unsigned long long carry = (unsigned long long) *a + *b + cf;
+        *c = carry;
+        return carry >> 32;
+    }
+    return cf;
+}
+
+static unsigned int bn_sub_limbs_adx(unsigned int *c,
+                                     const unsigned int *a,
+                                     const unsigned int *b,
+                                     unsigned int n)
+{
+    unsigned long words = n >> 1, tmp;
+    unsigned char cf = 0;
+
+    /* there is no ADX form of subtraction, SBB already has a single chain */
+    if (words) {
+        asm volatile(
+            "xor %k[tmp], %k[tmp]\n\t" /* clear CF */
+            "1:\n\t"
+            "movq (%[a]), %[tmp]\n\t"
+            "sbbq (%[b]), %[tmp]\n\t"
+            "movq %[tmp], (%[c])\n\t"
+            "leaq 8(%[a]), %[a]\n\t"
+            "leaq 8(%[b]), %[b]\n\t"
+            "leaq 8(%[c]), %[c]\n\t"
+            "dec %[n]\n\t" /* preserves CF */
+            "jnz 1b\n\t"
+            "setc %[cf]\n\t"
+            : [a] "+r"(a), [b] "+r"(b), [c] "+r"(c), [n] "+r"(words),
+              [tmp] "=&r"(tmp), [cf] "=q"(cf)
+            :
+            : "cc", "memory");
+    }
+
+    if (n & 1) {
+        unsigned long long diff = (unsigned long long) *a - *b - cf;
+        *c = diff;
+        return (diff >> 32) & 1;
+    }
+    return cf;
+}
+
+static unsigned int bn_addmul_limbs_adx(unsigned int *c,
+                                        const unsigned int *a,
+                                        unsigned int n,
+                                        unsigned int b)
+{
+    unsigned long words = n >> 1, lo, hi, carry = 0;
+
+    if (words) {
+        /* carry holds the high half of the previous product, it is added
+         * on the OF chain while the old value of c is added on the CF
+         * chain; RCX drives the loop since DEC would clobber OF
+         */
+        asm volatile(
+            "xor %k[carry], %k[carry]\n\t" /* clear CF and OF */
+            "1:\n\t"
+            "mulx (%[a]), %[lo], %[hi]\n\t"
+            "adox %[carry], %[lo]\n\t"
+            "adcx (%[c]), %[lo]\n\t"
+            "movq %[lo], (%[c])\n\t"
+            "movq %[hi], %[carry]\n\t"
+            "leaq 8(%[a]), %[a]\n\t"
+            "leaq 8(%[c]), %[c]\n\t"
+            "leaq -1(%[n]), %[n]\n\t"
+            "jrcxz 2f\n\t"
+            "jmp 1b\n\t"
+            "2:\n\t"
+            "movl $0, %k[lo]\n\t"
+            "adox %[lo], %[carry]\n\t"
+            "adcx %[lo], %[carry]\n\t"
+            : [a] "+r"(a), [c] "+r"(c), [n] "+c"(words), [carry] "=&r"(carry),
+              [lo] "=&r"(lo), [hi] "=&r"(hi)
+            : "d"((unsigned long) b)
+            : "cc", "memory");
+    }
+
+    /* the carry out of a full row always fits in one limb */
+    if (n & 1) {
+        unsigned long long t = (unsigned long long) *a * b + *c + carry;
+        *c = t;
+        return t >> 32;
+    }
+    return carry;
+}
+#endif
+
+static unsigned int bn_add_limbs(unsigned int *c,
+                                 const unsigned int *a,
+                                 const unsigned int *b,
+                                 unsigned int n)
+{
+    if (n && n <= bn_fixed_max)
+        return bn_fixed_add(c, a, b, n);
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_use_adx))
+        return bn_add_limbs_adx(c, a, b, n);
+#endif
+    return bn_add_limbs_generic(c, a, b, n);
+}
+
+static unsigned int bn_sub_limbs(unsigned int *c,
+                                 const unsigned int *a,
+                                 const unsigned int *b,
+                                 unsigned int n)
+{
+    if (n && n <= bn_fixed_max)
+        return bn_fixed_sub(c, a, b, n);
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_use_adx))
+        return bn_sub_limbs_adx(c, a, b, n);
+#endif
+    return bn_sub_limbs_generic(c, a, b, n);
+}
 
-        carry += (unsigned long long) tmp1 + tmp2;
+static unsigned int bn_addmul_limbs(unsigned int *c,
+                                    const unsigned int *a,
+                                    unsigned int n,
+                                    unsigned int b)
+{
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_use_adx))
+        return bn_addmul_limbs_adx(c, a, n, b);
+#endif
+    return bn_addmul_limbs_generic(c, a, n, b);
+}
+
+/* select the limb kernels for this CPU, call once before any bn operation */
+void bn_kernel_init(void)
+{
+#ifdef CONFIG_X86_64
+    if (boot_cpu_has(X86_FEATURE_ADX) && boot_cpu_has(X86_FEATURE_BMI2))
+        static_branch_enable(&bn_use_adx);
+#endif
+}
+
+/* drop leading zero limbs, keep at least one */
+static void bn_trim(bn *src)
+{
+    unsigned int size = src->size;
+    while (size > 1 && !src->number[size - 1])
+        size--;
+    bn_resize(src, size);
+}
+
+/* time a mul, a square and an add of n-limb operands, best of 3 runs */
+static s64 bn_time_ops(unsigned int n)
+{
+    bn *a = bn_alloc(n);
+    bn *b = bn_alloc(n);
+    bn *c = bn_alloc(1);
+    s64 best = S64_MAX;
+
+    for (unsigned int i = 0; i < n; i++) {
+        a->number[i] = 0x9E3779B9U * (i + 1);
+        b->number[i] = 0x7F4A7C15U * (i + 1);
+    }
+
+    for (int run = 0; run < 3; run++) {
+        ktime_t kt = ktime_get();
+        for (int i = 0; i < 1000; i++) {
+            bn_mul(a, b, c);
+            bn_mul(a, a, c);
+            bn_add(a, b, c);
+        }
+        best = min(best, ktime_to_ns(ktime_sub(ktime_get(), kt)));
+    }
+
+    bn_free(a);
+    bn_free(b);
+    bn_free(c);
+    return best;
+}
+
+/*
+ * measure where the generic or ADX row kernels start to beat the unrolled
+ * ones on this CPU, store it in bn_fixed_max and return it
+ *
+ * The two are close around the crossover, so rather than stopping at the
+ * first size the rows win, pick the cutoff with the largest total saving.
+ */
+unsigned int bn_kernel_calibrate(void)
+{
+    unsigned int best = 0;
+    s64 saved = 0, best_saved = 0;
+
+    for (unsigned int n = 1; n <= BN_FIXED_LIMBS; n++) {
+        bn_fixed_max = BN_FIXED_LIMBS;
+        s64 fixed = bn_time_ops(n);
+        bn_fixed_max = 0;
+        s64 rows = bn_time_ops(n);
+
+        saved += rows - fixed;
+        if (saved > best_saved) {
+            best_saved = saved;
+            best = n;
+        }
+    }
+
+    bn_fixed_max = best;
+    return best;
+}
+
+/* |c| = |a| + |b| */
+static void bn_do_add(const bn *a, const bn *b, bn *c)
+{
+    // max digits = max(sizeof(a) + sizeof(b)) + 1
+    if (a->size < b->size)
+        SWAP(a, b);
+    unsigned int asize = a->size, bsize = b->size;
+    bn_resize(c, asize + 1);
+
+    unsigned long long carry =
+        bn_add_limbs(c->number, a->number, b->number, bsize);
+    for (unsigned int i = bsize; i < asize; i++) {
+        carry += a->number[i];
         c->number[i] = carry;
         carry >>= 32;
     }
+    c->number[asize] = carry;
 
-    if (!c->number[c->size - 1] && c->size > 1)
-        bn_resize(c, c->size - 1);
+    bn_trim(c);
 }
 
 
@@ -109,25 +405,15 @@ static void bn_do_sub(const bn *a, const bn *b, bn *c)
     int d = MAX(a->size, b->size);
     bn_resize(c, d);
 
-    long long int carry = 0;
-    for (int i = 0; i < c->size; i++) {
-        unsigned int tmp1 = (i < a->size) ? a->number[i] : 0;
-        unsigned int tmp2 = (i < b->size) ? b->number[i] : 0;
-
-        carry = (long long int) tmp1 - tmp2 - carry;
-        if (carry < 0) {
-            c->number[i] = carry + (1LL << 32);
-            carry = 1;
-        } else {
-            c->number[i] = carry;
-            carry = 0;
-        }
+    unsigned int borrow = bn_sub_limbs(c->number, a->number, b->number,
+                                       b->size);
+    for (int i = b->size; i < c->size; i++) {
+        unsigned long long diff = (unsigned long long) a->number[i] - borrow;
+        c->number[i] = diff;
+        borrow = (diff >> 32) & 1;
     }
 
-    d = bn_clz(c) / 32;
-    if (d == c->size)
-        --d;
-    bn_resize(c, c->size - d);
+    bn_trim(c);
 }
 
 /* sizeof BigNum */
@@ -140,9 +426,11 @@ int bn_resize(bn *src, size_t size)
     if (size == 0)
         return bn_free(src);
 
-    src->number = krealloc(src->number, sizeof(int) * size, GFP_KERNEL);
-    if (!src->number)
+    unsigned int *number =
+        krealloc(src->number, sizeof(int) * size, GFP_KERNEL);
+    if (!number)
         return -1;
+    src->number = number;
     if (size > src->size)
         memset(src->number + src->size, 0, sizeof(int) * (size - src->size));
     src->size = size;
@@ -152,7 +440,13 @@ int bn_resize(bn *src, size_t size)
 bn *bn_alloc(size_t size)
 {
     bn *new = (bn *) kmalloc(sizeof(bn), GFP_KERNEL);
+    if (!new)
+        return NULL;
     new->number = kmalloc(sizeof(unsigned int) * size, GFP_KERNEL);
+    if (!new->number) {
+        kfree(new);
+        return NULL;
+    }
     memset(new->number, 0, sizeof(unsigned int) * size);
     new->size = size;
     new->sign = 0;
@@ -206,17 +500,16 @@ void bn_sub(const bn *a, const bn *b, bn *c)
     bn_add(a, &tmp, c);
 }
 
-static void bn_mul_add(bn *c, int offset, unsigned long long int x)
+/* zero-extend src into buf when it is shorter than n limbs */
+static const unsigned int *bn_fixed_pad(unsigned int *buf,
+                                        const bn *src,
+                                        unsigned int n)
 {
-    unsigned long long int carry = 0;
-    for (int i = offset; i < c->size; i++) {
-        carry += c->number[i] + (x & 0xFFFFFFFF);
-        c->number[i] = carry;
-        carry >>= 32;
-        x >>= 32;
-        if (!x && !carry)
-            return;
-    }
+    if (src->size == n)
+        return src->number;
+    memcpy(buf, src->number, sizeof(int) * src->size);
+    memset(buf + src->size, 0, sizeof(int) * (n - src->size));
+    return buf;
 }
 
 /* c = a * b
@@ -225,25 +518,45 @@ static void bn_mul_add(bn *c, int offset, unsigned long long int x)
 void bn_mul(const bn *a, const bn *b, bn *c)
 {
     // max digits = sizeof(a) + sizeof(b)
-    int d = bn_msb(a) + bn_msb(b);
-    d = DIV_ROUNDUP(d, 32) + !d;
+    unsigned int n = MAX(a->size, b->size);
     bn *tmp;
 
     if (c == a || c == b) {
         tmp = c;
-        c = bn_alloc(d);
+        c = bn_alloc(a->size + b->size);
     } else {
         tmp = NULL;
-        bn_resize(c, d);
+        bn_resize(c, a->size + b->size);
+        memset(c->number, 0, sizeof(int) * c->size);
     }
 
-    for (int i = 0; i < a->size; i++) {
-        for (int j = 0; j < b->size; j++) {
-            unsigned long long int carry = 0;
-            carry = (unsigned long long int) a->number[i] * b->number[j];
-            bn_mul_add(c, i + j, carry);
+    // the fixed kernels pad the shorter operand to n limbs, which only
+    // pays off while the sizes are close
+    if (n <= bn_fixed_max && 2 * min(a->size, b->size) >= n) {
+        unsigned int x[BN_FIXED_LIMBS], y[BN_FIXED_LIMBS];
+
+        bn_resize(c, 2 * n);
+        if (a == b)
+            bn_fixed_sqr(c->number, a->number, n);
+        else
+            bn_fixed_mul(c->number, bn_fixed_pad(x, a, n),
+                         bn_fixed_pad(y, b, n), n);
+    } else {
+        // one limb per row of partial products; a killed caller gets a
+        // garbage product, which it throws away at its next check
+        for (int i = 0; i < a->size; i++) {
+            if (!(i & 63)) {
+                cond_resched();
+                if (fatal_signal_pending(current))
+                    break;
+            }
+            if (!a->number[i])
+                continue;
+            c->number[i + b->size] = bn_addmul_limbs(
+                c->number + i, b->number, b->size, a->number[i]);
         }
     }
+    bn_trim(c);
 
     c->sign = a->sign ^ b->sign;
 
@@ -269,39 +582,55 @@ void bn_lshift(const bn *src, size_t offset)
     src->number[0] <<= offset;
 }
 
+/* returns NULL if out of memory or the caller was killed */
 char *bn_to_string(const bn *src)
 {
     // log10(x) = log2(x) / log2(10) ~= log2(x) / 3.322
     // 2 is `+` or `-` ; sign is `-`.
     size_t len = (8 * sizeof(int) * src->size) / 3 + 2 + src->sign;
     char *s = kmalloc(len, GFP_KERNEL);
-    char *p = s;
+    unsigned int *q = kmalloc_array(src->size, sizeof(int), GFP_KERNEL);
+    unsigned int n = src->size;
+    char *p = s + len - 1;
+
+    if (!s || !q) {
+        kfree(s);
+        kfree(q);
+        return NULL;
+    }
+    memcpy(q, src->number, sizeof(int) * n);
+    *p = '\0';
+
+    // divide by 10^9 until nothing is left, printing nine digits per
+    // remainder from the least significant end
+    while (n && !q[n - 1])
+        n--;
+    while (n) {
+        cond_resched();
+        if (fatal_signal_pending(current)) {
+            kfree(s);
+            kfree(q);
+            return NULL;
+        }
 
-    memset(s, '0', len - 1);
-    s[len - 1] = '\0';
+        u32 rem = 0;
+        for (int i = n - 1; i >= 0; i--)
+            q[i] = div_u64_rem((u64) rem << 32 | q[i], 1000000000, &rem);
+        while (n && !q[n - 1])
+            n--;
 
-    // iterate through each digit of the binary number from MSB to LSB
-    for (int i = src->size - 1; i >= 0; i--) {
-        for (unsigned int d = 1U << 31; d; d >>= 1) {
-            // binary -> decimal string
-            int carry = !!(d & src->number[i]);
-            for (int j = len - 2; j >= 0; j--) {
-                carry = 2 * (s[j] - '0') + carry;
-                s[j] = "0123456789"[carry % 10];
-                carry /= 10;
-                if (!s[j] && !carry)
-                    break;
-            }
+        // all nine digits, unless this is the most significant group
+        for (int d = 0; d < 9 && (n || rem); d++) {
+            *--p = '0' + rem % 10;
+            rem /= 10;
         }
     }
+    kfree(q);
 
-    while (p[0] == '0' && p[1] != '\0') {
-        p++;
-    }
-
-    if (src->sign) {
-        *(--p) = '-';
-    }
+    if (!*p)
+        *--p = '0';
+    if (src->sign)
+        *--p = '-';
 
     memmove(s, p, strlen(p) + 1);
     return s;
@@ -25,6 +25,13 @@ typedef struct _bn {
     int sign;
 } bn;
 
+/* largest operand, in limbs, with an unrolled kernel */
+#define BN_FIXED_LIMBS 16
+
+extern unsigned int bn_fixed_max;
+
+void bn_kernel_init(void);
+unsigned int bn_kernel_calibrate(void);
 bn *bn_alloc(size_t size);
 int bn_free(bn *src);
 void bn_init(bn *src, size_t size, unsigned int value);
@@ -1,11 +1,16 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fibdrv.h"
+
 #define FIB_DEV "/dev/fibonacci"
 #define DEBUG 0
 
@@ -22,7 +27,110 @@ static inline long long diff(struct timespec start, struct timespec end)
     return temp.tv_sec * 1e9 + temp.tv_nsec;
 }
 
-int main()
+/* client read START END: print fib[START..END] as read through lseek/read */
+static int read_range(int fd, int start, int end)
+{
+    char read_buf[40960];
+    for (int i = start; i <= end; i++) {
+        lseek(fd, i, SEEK_SET);
+        long long sz = read(fd, read_buf, sizeof(read_buf) - 1);
+        if (sz < 0) {
+            perror("read");
+            return 1;
+        }
+        read_buf[sz] = '\0';
+        printf("Reading from " FIB_DEV
+               " at offset %d, returned the sequence "
+               "%s.\n",
+               i, read_buf);
+    }
+    return 0;
+}
+
+/* client range START END: print fib[START..END] as exported by
+ * FIB_IOC_RANGE, in the same format as read_range. An empty buffer is
+ * offered first, which must fail with ENOSPC and report the size to use.
+ */
+static int export_range(int fd, int start, int end)
+{
+    struct fib_range r = {.start = start, .end = end};
+
+    if (ioctl(fd, FIB_IOC_RANGE, &r) == 0 || errno != ENOSPC || !r.len) {
+        fprintf(stderr, "FIB_IOC_RANGE: empty buffer not refused\n");
+        return 1;
+    }
+
+    char *buf = malloc(r.len);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    r.buf = (uintptr_t) buf;
+    r.size = r.len;
+    if (ioctl(fd, FIB_IOC_RANGE, &r) < 0) {
+        perror("FIB_IOC_RANGE");
+        free(buf);
+        return 1;
+    }
+
+    char *p = buf;
+    for (int i = start; i <= end; i++) {
+        char *nl = memchr(p, '\n', buf + r.len - p);
+        if (!nl) {
+            fprintf(stderr, "FIB_IOC_RANGE: offset %d missing\n", i);
+            free(buf);
+            return 1;
+        }
+        printf("Reading from " FIB_DEV
+               " at offset %d, returned the sequence "
+               "%.*s.\n",
+               i, (int) (nl - p), p);
+        p = nl + 1;
+    }
+    free(buf);
+    return 0;
+}
+
+/* client budget OFFSET: a 1 ns budget must make both a read and a range
+ * export of OFFSET fail with ETIME, and clearing it must make the read work
+ */
+static int check_budget(int fd, int offset)
+{
+    char read_buf[40960];
+    struct fib_range r = {.start = offset, .end = offset,
+                          .buf = (uintptr_t) read_buf,
+                          .size = sizeof(read_buf)};
+    __u64 budget = 1;
+
+    if (ioctl(fd, FIB_IOC_SET_BUDGET, &budget) < 0) {
+        perror("FIB_IOC_SET_BUDGET");
+        return 1;
+    }
+    lseek(fd, offset, SEEK_SET);
+    if (read(fd, read_buf, sizeof(read_buf)) >= 0 || errno != ETIME) {
+        fprintf(stderr, "read: budget not enforced\n");
+        return 1;
+    }
+    if (ioctl(fd, FIB_IOC_RANGE, &r) == 0 || errno != ETIME) {
+        fprintf(stderr, "FIB_IOC_RANGE: budget not enforced\n");
+        return 1;
+    }
+
+    budget = 0;
+    if (ioctl(fd, FIB_IOC_SET_BUDGET, &budget) < 0) {
+        perror("FIB_IOC_SET_BUDGET");
+        return 1;
+    }
+    lseek(fd, offset, SEEK_SET);
+    if (read(fd, read_buf, sizeof(read_buf)) < 0) {
+        perror("read");
+        return 1;
+    }
+    printf("budget: ETIME with 1 ns, read works without\n");
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
     char write_buf[] = "testing writing";
     int offset = 1000; /* TODO: try test something bigger than the limit */
@@ -33,6 +141,22 @@ int main()
         exit(1);
     }
 
+    if (argc == 4 && !strcmp(argv[1], "read")) {
+        int rc = read_range(fd, atoi(argv[2]), atoi(argv[3]));
+        close(fd);
+        return rc;
+    }
+    if (argc == 3 && !strcmp(argv[1], "budget")) {
+        int rc = check_budget(fd, atoi(argv[2]));
+        close(fd);
+        return rc;
+    }
+    if (argc == 4 && !strcmp(argv[1], "range")) {
+        int rc = export_range(fd, atoi(argv[2]), atoi(argv[3]));
+        close(fd);
+        return rc;
+    }
+
     FILE *output = fopen("Fibonacci_StringAdd.txt", "w");
 
     struct timespec start, end;
@@ -0,0 +1,172 @@
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "decimal_kernel.h"
+
+/* drop leading zero limbs, keep at least one */
+static void dbn_trim(dbn *src)
+{
+    unsigned int size = src->size;
+    while (size > 1 && !src->number[size - 1])
+        size--;
+    dbn_resize(src, size);
+}
+
+dbn *dbn_alloc(size_t size)
+{
+    dbn *new = kmalloc(sizeof(dbn), GFP_KERNEL);
+    if (!new)
+        return NULL;
+    new->number = kmalloc(sizeof(unsigned int) * size, GFP_KERNEL);
+    if (!new->number) {
+        kfree(new);
+        return NULL;
+    }
+    memset(new->number, 0, sizeof(unsigned int) * size);
+    new->size = size;
+    return new;
+}
+
+int dbn_free(dbn *src)
+{
+    if (src == NULL)
+        return -1;
+    kfree(src->number);
+    kfree(src);
+    return 0;
+}
+
+int dbn_resize(dbn *src, size_t size)
+{
+    if (!src || !size)
+        return -1;
+    if (size == src->size)
+        return 0;
+
+    unsigned int *number =
+        krealloc(src->number, sizeof(int) * size, GFP_KERNEL);
+    if (!number)
+        return -1;
+    src->number = number;
+    if (size > src->size)
+        memset(src->number + src->size, 0, sizeof(int) * (size - src->size));
+    src->size = size;
+    return 0;
+}
+
+/*
+ * copy the value from src to dest
+ * return 0 on success, -1 on error
+ */
+int dbn_cpy(dbn *dest, const dbn *src)
+{
+    if (dbn_resize(dest, src->size) < 0)
+        return -1;
+    memcpy(dest->number, src->number, src->size * sizeof(int));
+    return 0;
+}
+
+/* c = a + b */
+void dbn_add(const dbn *a, const dbn *b, dbn *c)
+{
+    if (a->size < b->size)
+        SWAP(a, b);
+
+    unsigned int asize = a->size, bsize = b->size;
+    dbn_resize(c, asize + 1);
+
+    unsigned int carry = 0;
+    for (unsigned int i = 0; i < asize; i++) {
+        unsigned int sum = a->number[i] + carry;
+        if (i < bsize)
+            sum += b->number[i];
+        carry = sum >= DBN_BASE;
+        c->number[i] = carry ? sum - DBN_BASE : sum;
+    }
+    c->number[asize] = carry;
+
+    dbn_trim(c);
+}
+
+/* c = a - b
+ *  a >= b must be true
+ */
+void dbn_sub(const dbn *a, const dbn *b, dbn *c)
+{
+    unsigned int asize = a->size, bsize = b->size;
+    dbn_resize(c, asize);
+
+    unsigned int borrow = 0;
+    for (unsigned int i = 0; i < asize; i++) {
+        unsigned int sub = borrow + (i < bsize ? b->number[i] : 0);
+        borrow = a->number[i] < sub;
+        c->number[i] = a->number[i] + (borrow ? DBN_BASE : 0) - sub;
+    }
+
+    dbn_trim(c);
+}
+
+/* c = a * b */
+void dbn_mul(const dbn *a, const dbn *b, dbn *c)
+{
+    dbn *tmp;
+
+    if (c == a || c == b) {
+        tmp = c;
+        c = dbn_alloc(a->size + b->size);
+    } else {
+        tmp = NULL;
+        dbn_resize(c, a->size + b->size);
+        memset(c->number, 0, sizeof(int) * c->size);
+    }
+
+    // a killed caller gets a garbage product; the engine checks for the
+    // signal after its last multiplication
+    for (unsigned int i = 0; i < a->size; i++) {
+        unsigned long long carry = 0;
+        if (!(i & 63)) {
+            cond_resched();
+            if (fatal_signal_pending(current))
+                break;
+        }
+        if (!a->number[i])
+            continue;
+        for (unsigned int j = 0; j < b->size; j++) {
+            // (BASE - 1)^2 + 2 * (BASE - 1) < 2^64
+            carry += (unsigned long long) a->number[i] * b->number[j] +
+                     c->number[i + j];
+            c->number[i + j] = carry % DBN_BASE;
+            carry /= DBN_BASE;
+        }
+        c->number[i + b->size] = carry;
+    }
+
+    dbn_trim(c);
+
+    if (tmp) {
+        dbn_cpy(tmp, c);
+        dbn_free(c);
+    }
+}
+
+/* every limb is already DBN_DIGITS decimal digits, so just print them;
+ * returns NULL if out of memory
+ */
+char *dbn_to_string(const dbn *src)
+{
+    size_t len = (size_t) src->size * DBN_DIGITS + 1;
+    char *s = kmalloc(len, GFP_KERNEL);
+    char *p = s;
+
+    if (!s)
+        return NULL;
+
+    p += snprintf(p, len, "%u", src->number[src->size - 1]);
+    for (int i = src->size - 2; i >= 0; i--)
+        p += snprintf(p, len - (p - s), "%09u", src->number[i]);
+
+    return s;
+}
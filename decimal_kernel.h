@@ -0,0 +1,33 @@
+#ifndef DECIMAL_KERNEL_H
+#define DECIMAL_KERNEL_H
+
+#include <linux/slab.h>
+#include <linux/string.h>
+
+/* each limb holds DBN_DIGITS decimal digits, least significant limb first */
+#define DBN_BASE 1000000000U
+#define DBN_DIGITS 9
+
+#ifndef SWAP
+#define SWAP(x, y)           \
+    do {                     \
+        typeof(x) __tmp = x; \
+        x = y;               \
+        y = __tmp;           \
+    } while (0)
+#endif
+
+typedef struct _dbn {
+    unsigned int *number;
+    unsigned int size;
+} dbn;
+
+dbn *dbn_alloc(size_t size);
+int dbn_free(dbn *src);
+int dbn_resize(dbn *src, size_t size);
+int dbn_cpy(dbn *dest, const dbn *src);
+void dbn_add(const dbn *a, const dbn *b, dbn *c);
+void dbn_sub(const dbn *a, const dbn *b, dbn *c);
+void dbn_mul(const dbn *a, const dbn *b, dbn *c);
+char *dbn_to_string(const dbn *src);
+#endif
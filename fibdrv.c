@@ -1,20 +1,31 @@
+#include <linux/atomic.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/init.h>
 #include <linux/kdev_t.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 // kmalloc
 #include <linux/slab.h>
-// __copy_to_user
+// copy_to_user
 #include <linux/uaccess.h>
 // ktime_t
 #include <linux/ktime.h>
 
 #include "bn_kernel.h"
+#include "decimal_kernel.h"
+#include "fibdrv.h"
 #include "stringAdd.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
@@ -32,31 +43,243 @@ MODULE_VERSION("0.1");
 static dev_t fib_dev = 0;
 static struct cdev *fib_cdev;
 static struct class *fib_class;
-static DEFINE_MUTEX(fib_mutex);
-static ktime_t kt;
+static DEFINE_MUTEX(fib_mutex); /* protects fib_flights */
 
-static long long bn_fib_fast_doubling_iterative_clz(long long k, char *buf)
+/* Fast doubling checkpoints.
+ * fib_cp[2 * j] = fib[j << fib_cp_shift], fib_cp[2 * j + 1] = fib[(j <<
+ * fib_cp_shift) + 1] for every checkpoint not greater than fib_cp_limit.
+ * A denser or longer table costs memory but saves full-size multiplications.
+ * The limit is clamped to FIB_CP_LIMIT_MAX, and the shift raised until the
+ * table has at most FIB_CP_COUNT_MAX checkpoints.
+ */
+#define FIB_CP_LIMIT_MAX (1U << 16)
+#define FIB_CP_COUNT_MAX 1024
+
+static unsigned int fib_cp_shift = 4;
+module_param(fib_cp_shift, uint, 0444);
+MODULE_PARM_DESC(fib_cp_shift, "log2 of the distance between checkpoints");
+
+static unsigned int fib_cp_limit = MAX_LENGTH;
+module_param(fib_cp_limit, uint, 0444);
+MODULE_PARM_DESC(fib_cp_limit,
+                 "Largest checkpointed offset (at most 65536), 0 disables");
+
+static bn *fib_cp;
+static unsigned int fib_cp_count;
+
+/* Algorithm crossovers. Both are measured at load unless fib_autotune is
+ * off, can be re-measured by writing to the calibrate parameter, and can be
+ * overridden by writing the parameter itself.
+ */
+static unsigned int fib_iter_max;
+module_param(fib_iter_max, uint, 0644);
+MODULE_PARM_DESC(fib_iter_max,
+                 "Offsets below this are read with bn_fib_iterative");
+
+/* serializes calibration with bn_fixed_max overrides */
+static DEFINE_MUTEX(fib_calibrate_lock);
+
+static int bn_fixed_max_set(const char *val, const struct kernel_param *kp)
 {
-    bn *f1 = bn_alloc(1);
-    if (k <= 2) {  // Fib(0) = 0, Fib(1) = 1
-        f1->number[0] = !!k;
-        char *ret = bn_to_string(f1);
-        size_t retSize = strlen(ret);
-        __copy_to_user(buf, ret, retSize);
-        bn_free(f1);
-        return retSize;
+    unsigned int n;
+    int rc = kstrtouint(val, 0, &n);
+    if (rc)
+        return rc;
+    if (n > BN_FIXED_LIMBS)
+        return -EINVAL;
+    // don't let a running calibration overwrite the override
+    mutex_lock(&fib_calibrate_lock);
+    bn_fixed_max = n;
+    mutex_unlock(&fib_calibrate_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops bn_fixed_max_ops = {
+    .set = bn_fixed_max_set,
+    .get = param_get_uint,
+};
+module_param_cb(bn_fixed_max, &bn_fixed_max_ops, &bn_fixed_max, 0644);
+MODULE_PARM_DESC(bn_fixed_max, "Largest operand, in limbs, using unrolled "
+                               "kernels (0 to " __stringify(BN_FIXED_LIMBS) ")");
+
+static int read_engine_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int n;
+    int rc = kstrtouint(val, 0, &n);
+    if (rc)
+        return rc;
+    if (n != 4 && n != 6 && n != 7)
+        return -EINVAL;
+    *(unsigned int *) kp->arg = n;
+    return 0;
+}
+
+static const struct kernel_param_ops read_engine_ops = {
+    .set = read_engine_set,
+    .get = param_get_uint,
+};
+
+/* engine for reads at or above fib_iter_max; 7 skips the radix conversion */
+static unsigned int read_engine = 4;
+module_param_cb(read_engine, &read_engine_ops, &read_engine, 0644);
+MODULE_PARM_DESC(read_engine,
+                 "Engine for offsets from fib_iter_max on: 4 bn recursive, "
+                 "6 bn iterative, 7 decimal iterative; write calibrate "
+                 "afterwards to re-measure fib_iter_max for it");
+
+static bool fib_autotune = true;
+module_param(fib_autotune, bool, 0444);
+MODULE_PARM_DESC(fib_autotune, "Calibrate the crossovers at load");
+
+
+static void fib_cp_destroy(void)
+{
+    for (unsigned int i = 0; i < 2 * fib_cp_count; i++)
+        kfree(fib_cp[i].number);
+    kfree(fib_cp);
+    fib_cp = NULL;
+    fib_cp_count = 0;
+}
+
+static int fib_cp_build(void)
+{
+    int rc = 0;
+
+    if (!fib_cp_limit)
+        return 0;
+    if (fib_cp_limit > FIB_CP_LIMIT_MAX)
+        fib_cp_limit = FIB_CP_LIMIT_MAX;
+    if (fib_cp_shift > 16)
+        fib_cp_shift = 16;
+    while ((fib_cp_limit >> fib_cp_shift) >= FIB_CP_COUNT_MAX)
+        fib_cp_shift++;
+
+    fib_cp_count = (fib_cp_limit >> fib_cp_shift) + 1;
+    fib_cp = kcalloc(2 * fib_cp_count, sizeof(bn), GFP_KERNEL);
+    if (!fib_cp) {
+        fib_cp_count = 0;
+        return -ENOMEM;
     }
 
-    bn *f2 = bn_alloc(1);
-    f1->number[0] = 1;  // fib[k]
-    f2->number[0] = 1;  // fib[k+1]
+    bn *a = bn_alloc(1);  // fib[i]
+    bn *b = bn_alloc(1);  // fib[i+1]
+    if (!a || !b) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    b->number[0] = 1;
+
+    for (unsigned int i = 0, j = 0; j < fib_cp_count; i++) {
+        if (!(i & ((1U << fib_cp_shift) - 1))) {
+            if (bn_cpy(&fib_cp[2 * j], a) < 0 ||
+                bn_cpy(&fib_cp[2 * j + 1], b) < 0) {
+                rc = -ENOMEM;
+                goto out;
+            }
+            j++;
+            cond_resched();
+        }
+        bn_add(a, b, a);
+        bn_swap(a, b);
+    }
+
+out:
+    bn_free(a);
+    bn_free(b);
+    if (rc)
+        fib_cp_destroy();
+    return rc;
+}
+
+/* limits of one computation */
+struct fib_ctx {
+    struct task_struct *task; /* aborts on its fatal signals, may be NULL */
+    ktime_t deadline;         /* aborts past this time, 0 for none */
+};
+
+/* give up the CPU if needed, and tell whether the computation must stop */
+static int fib_check(const struct fib_ctx *ctx)
+{
+    cond_resched();
+    if (ctx->task && fatal_signal_pending(ctx->task))
+        return -EINTR;
+    if (ctx->deadline && ktime_after(ktime_get(), ctx->deadline))
+        return -ETIME;
+    return 0;
+}
+
+/* bn_to_string() reporting why it failed: it gives up on fatal signals */
+static char *fib_bn_to_string(const bn *src, const struct fib_ctx *ctx)
+{
+    char *s = bn_to_string(src);
+    if (!s) {
+        int rc = fib_check(ctx);
+        return ERR_PTR(rc ? rc : -ENOMEM);
+    }
+    return s;
+}
 
+/*
+ * f1 = fib[j], f2 = fib[j + 1] for j <= fib_cp_limit, walking by addition
+ * from the checkpoint at or below j; tmp is scratch
+ */
+static int fib_cp_seed(long long j,
+                       bn *f1,
+                       bn *f2,
+                       bn *tmp,
+                       const struct fib_ctx *ctx)
+{
+    long long idx = j >> fib_cp_shift;
+    int rc = 0;
+
+    if (bn_cpy(f1, &fib_cp[2 * idx]) < 0 ||
+        bn_cpy(f2, &fib_cp[2 * idx + 1]) < 0)
+        return -ENOMEM;
+
+    for (long long i = idx << fib_cp_shift; i < j; i++) {
+        rc = fib_check(ctx);
+        if (rc)
+            break;
+        bn_add(f1, f2, tmp);
+        bn_swap(f1, f2);
+        bn_swap(f2, tmp);
+    }
+    return rc;
+}
+
+/* f1 = fib[k], f2 = fib[k + 1] */
+static int bn_fib_pair(long long k, bn *f1, bn *f2, const struct fib_ctx *ctx)
+{
     bn *k1 = bn_alloc(1);
     bn *k2 = bn_alloc(1);
+    int rc = 0;
 
-    uint8_t count = 63 - __builtin_clzll(k);
+    if (!k1 || !k2) {
+        bn_free(k1);
+        bn_free(k2);
+        return -ENOMEM;
+    }
 
-    for (uint64_t i = count; i-- > 0;) {
+    uint8_t count = k ? 63 - __builtin_clzll(k) : 0;
+
+    if (fib_cp_count) {
+        /* drop low bits until the prefix of k is covered by the table */
+        count = 0;
+        while ((k >> count) > fib_cp_limit)
+            count++;
+
+        rc = fib_cp_seed(k >> count, f1, f2, k2, ctx);
+    } else {
+        bn_resize(f1, 1);
+        bn_resize(f2, 1);
+        f1->number[0] = !!k;  // fib[k]
+        f2->number[0] = 1;    // fib[k+1]
+    }
+
+    for (uint64_t i = count; !rc && i-- > 0;) {
+        rc = fib_check(ctx);
+        if (rc)
+            break;
         // fib[2k] = fib[k] * (fib[k + 1] * 2 - fib[k]);
         bn_cpy(k1, f2);
         bn_lshift(k1, 1);
@@ -77,83 +300,191 @@ static long long bn_fib_fast_doubling_iterative_clz(long long k, char *buf)
         }
     }
 
-    char *ret = bn_to_string(f1);
-    size_t retSize = strlen(ret);
-    __copy_to_user(buf, ret, retSize);
-
     bn_free(k1);
     bn_free(k2);
+    return rc;
+}
+
+static char *bn_fib_fast_doubling_iterative_clz(long long k,
+                                                const struct fib_ctx *ctx)
+{
+    bn *f1 = bn_alloc(1);
+    bn *f2 = bn_alloc(1);
+
+    int rc = f1 && f2 ? bn_fib_pair(k, f1, f2, ctx) : -ENOMEM;
+    char *ret = rc ? ERR_PTR(rc) : fib_bn_to_string(f1, ctx);
+
     bn_free(f2);
     bn_free(f1);
 
-    return retSize;
+    return ret;
 }
 
-static long long bn_fib_iterative(unsigned int n, char *buf)
+/* same recurrence as bn_fib_fast_doubling_iterative_clz, but in base 10^9 so
+ * the result can be printed limb by limb without a radix conversion
+ */
+static char *dbn_fib_fast_doubling_iterative(long long k,
+                                             const struct fib_ctx *ctx)
+{
+    dbn *f1 = dbn_alloc(1);
+    dbn *f2 = dbn_alloc(1);
+    dbn *k1 = dbn_alloc(1);
+    dbn *k2 = dbn_alloc(1);
+    char *ret = NULL;
+    int rc = 0;
+
+    if (!f1 || !f2 || !k1 || !k2)
+        goto out;
+
+    if (k <= 2) {  // Fib(0) = 0, Fib(1) = 1
+        f1->number[0] = !!k;
+        ret = dbn_to_string(f1);
+        goto out;
+    }
+
+    f1->number[0] = 1;  // fib[k]
+    f2->number[0] = 1;  // fib[k+1]
+
+    uint8_t count = 63 - __builtin_clzll(k);
+
+    for (uint64_t i = count; i-- > 0;) {
+        rc = fib_check(ctx);
+        if (rc)
+            break;
+        // fib[2k] = fib[k] * (fib[k + 1] * 2 - fib[k]);
+        dbn_add(f2, f2, k1);
+        dbn_sub(k1, f1, k1);
+        dbn_mul(f1, k1, k1);
+        // fib[2k + 1] = fib[k] * fib[k] + fib[k+1] * fib[k+1]
+        dbn_mul(f1, f1, f1);
+        dbn_mul(f2, f2, f2);
+        dbn_add(f1, f2, k2);
+
+        if (k & (1UL << i)) {
+            SWAP(f1, k2);  // 2k + 1
+            dbn_add(k1, f1, f2);
+        } else {
+            SWAP(f1, k1);
+            SWAP(f2, k2);
+        }
+    }
+
+    // dbn_mul() gives up on a fatal signal, so the last product may be
+    // garbage that must not reach other readers of this flight
+    if (!rc)
+        rc = fib_check(ctx);
+    ret = rc ? ERR_PTR(rc) : dbn_to_string(f1);
+
+out:
+    dbn_free(k1);
+    dbn_free(k2);
+    dbn_free(f2);
+    dbn_free(f1);
+
+    return ret;
+}
+
+static char *bn_fib_iterative(unsigned int n, const struct fib_ctx *ctx)
 {
     bn *dest = bn_alloc(1);
+    bn *a = bn_alloc(1);
+    bn *b = bn_alloc(1);
+    char *ret;
+    int rc = 0;
+
+    if (!dest || !a || !b) {
+        ret = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+
     if (n <= 2) {  // Fib(0) = 0, Fib(1) = 1
         dest->number[0] = !!n;
-        return 1;
+        ret = fib_bn_to_string(dest, ctx);
+        goto out;
     }
 
-    bn *a = bn_alloc(1);
-    bn *b = bn_alloc(1);
     dest->number[0] = 1;
 
     for (unsigned int i = 1; i < n; i++) {
+        if (!(i & 63) && (rc = fib_check(ctx)))
+            break;
         bn_cpy(b, dest);        // b = dest
         bn_add(dest, a, dest);  // dest += a
         bn_swap(a, b);          // SWAP(a, b)
     }
+    ret = rc ? ERR_PTR(rc) : fib_bn_to_string(dest, ctx);
+
+out:
     bn_free(a);
     bn_free(b);
-    char *ret = bn_to_string(dest);
     bn_free(dest);
-
-    size_t retSize = strlen(ret);
-    __copy_to_user(buf, ret, retSize);
-    return retSize;
+    return ret;
 }
 
-static bn bn_fib_helper(long long k, bn *fib, bn *c)
+/*
+ * f1 = fib[k], f2 = fib[k + 1], from the pair for k / 2 one level down, or
+ * from the checkpoint table once k is covered by it; t1 and t2 are scratch
+ * shared by all levels
+ */
+static int bn_fib_helper(long long k,
+                         bn *f1,
+                         bn *f2,
+                         bn *t1,
+                         bn *t2,
+                         const struct fib_ctx *ctx)
 {
-    if (k <= 2) {
-        long long tmp = k;
-        bn_init(&fib[k], 1, !!tmp);
-        return fib[k];
+    if (fib_cp_count && k <= fib_cp_limit)
+        return fib_cp_seed(k, f1, f2, t1, ctx);
+
+    if (!k) {
+        bn_resize(f1, 1);
+        bn_resize(f2, 1);
+        f1->number[0] = 0;
+        f2->number[0] = 1;
+        return 0;
     }
 
-    bn a = bn_fib_helper((k >> 1), fib, c);
-    bn b = bn_fib_helper((k >> 1) + 1, fib, c);
+    int rc = bn_fib_helper(k >> 1, f1, f2, t1, t2, ctx);
+    if (!rc)
+        rc = fib_check(ctx);
+    if (rc)
+        return rc;
 
-    bn_init(&fib[k], 1, 0);
-    bn_init(&c[0], 1, 0);
-    bn_init(&c[1], 1, 0);
+    bn_cpy(t1, f2);
+    bn_lshift(t1, 1);
+    bn_sub(t1, f1, t1);
+    bn_mul(t1, f1, t1);  // t1 = fib[2m] = fib[m] * (2 * fib[m + 1] - fib[m])
+    bn_mul(f1, f1, f1);
+    bn_mul(f2, f2, f2);
+    bn_add(f1, f2, t2);  // t2 = fib[2m + 1] = fib[m] ^ 2 + fib[m + 1] ^ 2
 
     if (k & 1) {
-        bn_mul(&a, &a, &c[0]);          // c0 = a * a
-        bn_mul(&b, &b, &c[1]);          // c1 = b * b
-        bn_add(&c[0], &c[1], &fib[k]);  // fib[k] = a * a + b * b
+        bn_add(t1, t2, f2);
+        bn_swap(f1, t2);
     } else {
-        bn_cpy(&c[0], &b);
-        bn_lshift(&c[0], 1);         // c0 = 2 * b
-        bn_sub(&c[0], &a, &c[1]);    // c1 = 2 * b - a
-        bn_mul(&a, &c[1], &fib[k]);  // fib[k] = a * (2 * b - a)
+        bn_swap(f1, t1);
+        bn_swap(f2, t2);
     }
-
-    return fib[k];
+    return 0;
 }
 
-static long long bn_fib_fast_doubling_recursive(long long k, char *buf)
+static char *bn_fib_fast_doubling_recursive(long long k,
+                                            const struct fib_ctx *ctx)
 {
-    bn *fib = (bn *) kmalloc((k + 2) * sizeof(bn), GFP_KERNEL);
-    bn *c = (bn *) kmalloc(2 * sizeof(bn), GFP_KERNEL);
-    bn_fib_helper(k, fib, c);
-    char *ret = bn_to_string(&fib[k]);
-    size_t retSize = strlen(ret);
-    __copy_to_user(buf, ret, retSize);
-    return retSize;
+    bn *f1 = bn_alloc(1);
+    bn *f2 = bn_alloc(1);
+    bn *t1 = bn_alloc(1);
+    bn *t2 = bn_alloc(1);
+
+    int rc = f1 && f2 && t1 && t2 ? bn_fib_helper(k, f1, f2, t1, t2, ctx)
+                                  : -ENOMEM;
+    char *ret = rc ? ERR_PTR(rc) : fib_bn_to_string(f1, ctx);
+
+    bn_free(t2);
+    bn_free(t1);
+    bn_free(f2);
+    bn_free(f1);
+    return ret;
 }
 
 static long long fib_sequence_fast_doubling_iterative(long long k)
@@ -195,7 +526,7 @@ static long long fib_sequence_fast_doubling_recursive(long long k)
     return a * ((b << 1) - a);
 }
 
-static long long fib_sequence_string_add(long long k, char *buf)
+static char *fib_sequence_string_add(long long k, const struct fib_ctx *ctx)
 {
     // GFP_KERNEL is a flag used for memory allocation in the Linux kernel.
     str_t *f = kmalloc((k + 2) * sizeof(str_t), GFP_KERNEL);
@@ -206,12 +537,17 @@ static long long fib_sequence_string_add(long long k, char *buf)
     f[1].numberStr[1] = '\0';
 
     for (int i = 2; i <= k; i++) {
+        int rc = (i & 63) ? 0 : fib_check(ctx);
+        if (rc) {
+            kfree(f);
+            return ERR_PTR(rc);
+        }
         add_str(f[i - 1].numberStr, f[i - 2].numberStr, f[i].numberStr);
     }
-    size_t retSize = strlen(f[k].numberStr);
-    reverse_str(f[k].numberStr, retSize);
-    __copy_to_user(buf, f[k].numberStr, retSize);
-    return retSize;
+    reverse_str(f[k].numberStr, strlen(f[k].numberStr));
+    char *ret = kstrdup(f[k].numberStr, GFP_KERNEL);
+    kfree(f);
+    return ret;
 }
 
 static long long fib_sequence_basic(long long k)
@@ -229,64 +565,361 @@ static long long fib_sequence_basic(long long k)
     return f[k];
 }
 
-static int fib_open(struct inode *inode, struct file *file)
-{
-    if (!mutex_trylock(&fib_mutex)) {
-        printk(KERN_ALERT "fibdrv is in use");
-        return -EBUSY;
-    }
-    return 0;
-}
-
-static int fib_release(struct inode *inode, struct file *file)
+/*
+ * calculate fib[k] with the given engine, as a kmalloc'ed decimal string,
+ * or an ERR_PTR() if it ran out of memory or was stopped by ctx
+ */
+static char *fib_compute(long long k, int mode, const struct fib_ctx *ctx)
 {
-    mutex_unlock(&fib_mutex);
-    return 0;
-}
+    char *ret;
 
-static long long fib_time_proxy(long long k, char *buf, int mode)
-{
-    long long result = 0;
     switch (mode) {
     case 0:
-        kt = ktime_get();
-        result = fib_sequence_basic(k);
-        kt = ktime_sub(ktime_get(), kt);
+        ret = kasprintf(GFP_KERNEL, "%lld", fib_sequence_basic(k));
         break;
     case 1:
-        kt = ktime_get();
-        result = fib_sequence_string_add(k, buf);
-        kt = ktime_sub(ktime_get(), kt);
+        ret = fib_sequence_string_add(k, ctx);
         break;
     case 2:
-        kt = ktime_get();
-        result = fib_sequence_fast_doubling_recursive(k);
-        kt = ktime_sub(ktime_get(), kt);
+        ret = kasprintf(GFP_KERNEL, "%lld",
+                        fib_sequence_fast_doubling_recursive(k));
         break;
     case 3:
-        kt = ktime_get();
-        result = fib_sequence_fast_doubling_iterative(k);
-        kt = ktime_sub(ktime_get(), kt);
+        ret = kasprintf(GFP_KERNEL, "%lld",
+                        fib_sequence_fast_doubling_iterative(k));
         break;
     case 4:
-        kt = ktime_get();
-        result = bn_fib_fast_doubling_recursive(k, buf);
-        kt = ktime_sub(ktime_get(), kt);
+        ret = bn_fib_fast_doubling_recursive(k, ctx);
         break;
     case 5:
-        kt = ktime_get();
-        result = bn_fib_iterative(k, buf);
-        kt = ktime_sub(ktime_get(), kt);
+        ret = bn_fib_iterative(k, ctx);
         break;
     case 6:
-        kt = ktime_get();
-        bn_fib_fast_doubling_iterative_clz(k, buf);
-        kt = ktime_sub(ktime_get(), kt);
-    default:
+        ret = bn_fib_fast_doubling_iterative_clz(k, ctx);
         break;
+    case 7:
+        ret = dbn_fib_fast_doubling_iterative(k, ctx);
+        break;
+    default:
+        return ERR_PTR(-EINVAL);
     }
 
-    return result;
+    return ret ? ret : ERR_PTR(-ENOMEM);
+}
+
+/* computations on behalf of the module itself run without limits */
+static const struct fib_ctx fib_ctx_none;
+
+/* best of 3 runs of the given engine, in ns */
+static s64 fib_time_engine(long long k, int mode)
+{
+    s64 best = S64_MAX;
+
+    for (int run = 0; run < 3; run++) {
+        ktime_t kt = ktime_get();
+        char *ret = fib_compute(k, mode, &fib_ctx_none);
+        best = min(best, ktime_to_ns(ktime_sub(ktime_get(), kt)));
+        if (!IS_ERR(ret))
+            kfree(ret);
+    }
+    return best;
+}
+
+/* measure bn_fixed_max and, for the current read_engine, fib_iter_max */
+static void fib_calibrate(void)
+{
+    unsigned int k;
+
+    mutex_lock(&fib_calibrate_lock);
+    bn_kernel_calibrate();
+
+    // first offset where read_engine beats repeated addition; readers can't
+    // go past MAX_LENGTH, so stop there and leave it read_engine's offset
+    unsigned int engine = READ_ONCE(read_engine);
+    for (k = 8; k < MAX_LENGTH; k <<= 1) {
+        if (fib_time_engine(k, engine) < fib_time_engine(k, 5))
+            break;
+    }
+    fib_iter_max = min(k, (unsigned int) MAX_LENGTH);
+    mutex_unlock(&fib_calibrate_lock);
+
+    printk(KERN_INFO "fibdrv: bn_fixed_max = %u, fib_iter_max = %u",
+           bn_fixed_max, fib_iter_max);
+}
+
+static int fib_calibrate_set(const char *val, const struct kernel_param *kp)
+{
+    fib_calibrate();
+    return 0;
+}
+
+static const struct kernel_param_ops fib_calibrate_ops = {
+    .set = fib_calibrate_set,
+};
+module_param_cb(calibrate, &fib_calibrate_ops, NULL, 0200);
+MODULE_PARM_DESC(calibrate, "Write anything to re-run the calibration");
+
+/*
+ * Single-flight: concurrent readers of the same offset share one
+ * computation. The first reader (the leader) publishes a fib_flight in
+ * fib_flights, computes the result and completes it; readers arriving
+ * meanwhile take a reference and sleep on the completion. The entry leaves
+ * the table once done, so later readers start a fresh computation, and the
+ * result is freed with the last reference.
+ */
+struct fib_flight {
+    long long k;
+    struct hlist_node node;
+    struct kref ref;
+    struct completion done;
+    char *result;
+    size_t len;
+    int err; /* set instead of result if the computation failed */
+};
+
+static DEFINE_HASHTABLE(fib_flights, 6);
+
+static void fib_flight_free(struct kref *ref)
+{
+    struct fib_flight *fl = container_of(ref, struct fib_flight, ref);
+    kfree(fl->result);
+    kfree(fl);
+}
+
+static void fib_flight_put(struct fib_flight *fl)
+{
+    kref_put(&fl->ref, fib_flight_free);
+}
+
+/* wait for another reader's flight within the limits of ctx */
+static int fib_flight_wait(struct fib_flight *fl, const struct fib_ctx *ctx)
+{
+    long rc;
+
+    if (completion_done(&fl->done))
+        return 0;
+
+    if (!ctx->deadline) {
+        rc = wait_for_completion_killable(&fl->done);
+    } else {
+        s64 left = ktime_to_ns(ktime_sub(ctx->deadline, ktime_get()));
+        if (left <= 0)
+            return -ETIME;
+        rc = wait_for_completion_killable_timeout(&fl->done,
+                                                  nsecs_to_jiffies(left));
+        if (!rc)
+            return -ETIME;
+    }
+
+    return rc < 0 ? -EINTR : 0;
+}
+
+/*
+ * return the finished flight for k, computing it or waiting for it; if the
+ * flight we waited for was cut short by its leader's own limits, try again
+ * under ours
+ */
+static struct fib_flight *fib_flight_get(long long k,
+                                         const struct fib_ctx *ctx)
+{
+    struct fib_flight *fl;
+
+again:
+    mutex_lock(&fib_mutex);
+    hash_for_each_possible(fib_flights, fl, node, k) {
+        if (fl->k != k)
+            continue;
+        kref_get(&fl->ref);
+        mutex_unlock(&fib_mutex);
+
+        int rc = fib_flight_wait(fl, ctx);
+        if (!rc && (fl->err == -EINTR || fl->err == -ETIME)) {
+            fib_flight_put(fl);
+            goto again;
+        }
+        if (rc) {
+            fib_flight_put(fl);
+            return ERR_PTR(rc);
+        }
+        return fl;
+    }
+
+    fl = kzalloc(sizeof(*fl), GFP_KERNEL);
+    if (!fl) {
+        mutex_unlock(&fib_mutex);
+        return ERR_PTR(-ENOMEM);
+    }
+    fl->k = k;
+    kref_init(&fl->ref);
+    init_completion(&fl->done);
+    hash_add(fib_flights, &fl->node, k);
+    mutex_unlock(&fib_mutex);
+
+    char *ret = fib_compute(k, k < fib_iter_max ? 5 : READ_ONCE(read_engine),
+                            ctx);
+    if (IS_ERR(ret)) {
+        fl->err = PTR_ERR(ret);
+    } else {
+        fl->result = ret;
+        fl->len = strlen(ret);
+    }
+
+    mutex_lock(&fib_mutex);
+    hash_del(&fl->node);
+    mutex_unlock(&fib_mutex);
+    complete_all(&fl->done);
+
+    return fl;
+}
+
+/*
+ * Speculative prefetch: every open file tracks the stride between its
+ * reads. Once the same non-zero stride has been seen FIB_PREFETCH_HITS times
+ * in a row, a work item on fib_prefetch_wq computes the next offsets along
+ * it, through fib_flight_get() so a racing reader simply joins, and parks
+ * the finished flights in the file's buffer until they are read. A broken
+ * pattern drops the buffer.
+ */
+#define FIB_PREFETCH_HITS 2
+#define FIB_PREFETCH_MAX 64
+
+static unsigned int prefetch_depth;
+module_param(prefetch_depth, uint, 0644);
+MODULE_PARM_DESC(prefetch_depth,
+                 "Results prefetched per open file (at most 64), 0 disables");
+
+static unsigned int prefetch_workers = 1;
+module_param(prefetch_workers, uint, 0444);
+MODULE_PARM_DESC(prefetch_workers,
+                 "Prefetch computations running at once; they run at the "
+                 "default nice level unless changed through "
+                 "/sys/devices/virtual/workqueue/fibdrv_prefetch/nice");
+
+static struct workqueue_struct *fib_prefetch_wq;
+
+/* per open file state */
+struct fib_file {
+    ktime_t kt;    /* time spent in the last read */
+    u64 budget_ns; /* per-request time limit, 0 for none */
+
+    spinlock_t lock; /* protects everything below */
+    long long last;  /* offset of the last read */
+    long long stride;
+    unsigned int hits;
+    unsigned int count;
+    struct fib_flight *prefetched[FIB_PREFETCH_MAX];
+    struct work_struct work;
+};
+
+/* next offset to prefetch, or -1 when there is nothing to do */
+static long long fib_prefetch_next(struct fib_file *ff)
+{
+    unsigned int depth = min(prefetch_depth, (unsigned int) FIB_PREFETCH_MAX);
+    long long k;
+
+    if (ff->hits < FIB_PREFETCH_HITS || ff->count >= depth)
+        return -1;
+
+    k = (ff->count ? ff->prefetched[ff->count - 1]->k : ff->last) + ff->stride;
+    if (k < 0 || k > MAX_LENGTH)
+        return -1;
+    return k;
+}
+
+static void fib_prefetch_work(struct work_struct *work)
+{
+    struct fib_file *ff = container_of(work, struct fib_file, work);
+    long long k;
+
+    spin_lock(&ff->lock);
+    while ((k = fib_prefetch_next(ff)) >= 0) {
+        spin_unlock(&ff->lock);
+
+        struct fib_flight *fl = fib_flight_get(k, &fib_ctx_none);
+        if (IS_ERR(fl))
+            return;
+
+        spin_lock(&ff->lock);
+        // the reader may have moved on while we were computing
+        if (fib_prefetch_next(ff) != k || fl->err) {
+            fib_flight_put(fl);
+            break;
+        }
+        ff->prefetched[ff->count++] = fl;
+    }
+    spin_unlock(&ff->lock);
+}
+
+/* drop prefetched results, called with ff->lock held */
+static void fib_prefetch_flush(struct fib_file *ff)
+{
+    for (unsigned int i = 0; i < ff->count; i++)
+        fib_flight_put(ff->prefetched[i]);
+    ff->count = 0;
+}
+
+/*
+ * note a read of k, and return its prefetched result if there is one;
+ * entries at or behind k along the stride are no longer useful
+ */
+static struct fib_flight *fib_prefetch_take(struct fib_file *ff, long long k)
+{
+    struct fib_flight *fl = NULL;
+    unsigned int i = 0;
+
+    spin_lock(&ff->lock);
+    if (!READ_ONCE(prefetch_depth) && !ff->count) {
+        spin_unlock(&ff->lock);
+        return NULL;
+    }
+
+    if (k - ff->last == ff->stride && ff->stride) {
+        if (ff->hits < FIB_PREFETCH_HITS)
+            ff->hits++;
+    } else {
+        ff->stride = k - ff->last;
+        ff->hits = 0;
+        fib_prefetch_flush(ff);
+    }
+    ff->last = k;
+
+    while (i < ff->count && (ff->prefetched[i]->k - k) * ff->stride <= 0) {
+        if (ff->prefetched[i]->k == k && !fl)
+            fl = ff->prefetched[i];
+        else
+            fib_flight_put(ff->prefetched[i]);
+        i++;
+    }
+    ff->count -= i;
+    memmove(ff->prefetched, ff->prefetched + i,
+            ff->count * sizeof(ff->prefetched[0]));
+
+    if (fib_prefetch_next(ff) >= 0)
+        queue_work(fib_prefetch_wq, &ff->work);
+    spin_unlock(&ff->lock);
+
+    return fl;
+}
+
+static int fib_open(struct inode *inode, struct file *file)
+{
+    struct fib_file *ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+    if (!ff)
+        return -ENOMEM;
+    spin_lock_init(&ff->lock);
+    INIT_WORK(&ff->work, fib_prefetch_work);
+    file->private_data = ff;
+    return 0;
+}
+
+static int fib_release(struct inode *inode, struct file *file)
+{
+    struct fib_file *ff = file->private_data;
+
+    cancel_work_sync(&ff->work);
+    fib_prefetch_flush(ff);
+    kfree(ff);
+    return 0;
 }
 
 /* calculate the fibonacci number at given offset */
@@ -295,16 +928,238 @@ static ssize_t fib_read(struct file *file,
                         size_t size,
                         loff_t *offset)
 {
-    return (ssize_t) fib_time_proxy(*offset, buf, 4);
+    struct fib_file *ff = file->private_data;
+    ktime_t kt = ktime_get();
+    ssize_t ret;
+
+    struct fib_ctx ctx = {
+        .task = current,
+        .deadline = ff->budget_ns ? ktime_add_ns(kt, ff->budget_ns) : 0,
+    };
+
+    struct fib_flight *fl = fib_prefetch_take(ff, *offset);
+    if (!fl)
+        fl = fib_flight_get(*offset, &ctx);
+    if (IS_ERR(fl))
+        return PTR_ERR(fl);
+
+    if (fl->err)
+        ret = fl->err;
+    else if (copy_to_user(buf, fl->result, fl->len))
+        ret = -EFAULT;
+    else
+        ret = fl->len;
+    fib_flight_put(fl);
+
+    ff->kt = ktime_sub(ktime_get(), kt);
+    return ret;
 }
 
-/* write operation is skipped */
+/* write operation is skipped, report the time spent in the last read */
 static ssize_t fib_write(struct file *file,
                          const char *buf,
                          size_t size,
                          loff_t *offset)
 {
-    return ktime_to_ns(kt);
+    struct fib_file *ff = file->private_data;
+    return ktime_to_ns(ff->kt);
+}
+
+/*
+ * Range export: [start, end] is cut into up to FIB_RANGE_SPLIT chunks per
+ * online CPU, each computed by a work item on system_unbound_wq. A chunk
+ * seeds itself with bn_fib_pair() and then only adds. Later chunks cost
+ * more (bigger numbers), so there are more chunks than CPUs to keep them
+ * all busy. The results are copied to user space in order. The chunks stop
+ * on the caller's fatal signals and the file's budget, like a read would.
+ * They also stop as soon as their output together overflows the caller's
+ * buffer, so at most about r.size bytes of strings are ever held.
+ */
+#define FIB_RANGE_SPLIT 4
+
+static unsigned int range_max = 10000;
+module_param(range_max, uint, 0644);
+MODULE_PARM_DESC(range_max, "Most numbers returned by one FIB_IOC_RANGE");
+
+static unsigned int range_end_max = 10 * MAX_LENGTH;
+module_param(range_end_max, uint, 0644);
+MODULE_PARM_DESC(range_end_max, "Largest offset FIB_IOC_RANGE computes");
+
+struct fib_range_chunk {
+    struct work_struct work;
+    const struct fib_ctx *ctx;
+    atomic64_t *used; /* bytes produced by all chunks so far */
+    atomic_t *pending;       /* chunks still running, plus the caller */
+    struct completion *done; /* completed by the last chunk to finish */
+    u64 size;         /* room in the caller's buffer */
+    long long start, end;
+    char **strs; /* fib[start..end] as decimal strings */
+    size_t len;  /* total length of strs */
+    int err;
+};
+
+/*
+ * bounds on the bytes fib[start..end] take, one per line: fib[k] has
+ * floor(k * log10(phi) - log10(sqrt(5))) + 1 digits for k > 0, and
+ * log10(phi) = 0.2089876...
+ */
+static u64 fib_range_bytes(u64 start, u64 end, bool upper)
+{
+    u64 bytes = 0;
+    for (u64 k = start; k <= end; k++)
+        bytes += upper ? k * 20899 / 100000 + 2 : k * 20898 / 100000 + 1;
+    return bytes;
+}
+
+static void fib_range_work(struct work_struct *work)
+{
+    struct fib_range_chunk *c =
+        container_of(work, struct fib_range_chunk, work);
+    bn *a = bn_alloc(1);
+    bn *b = bn_alloc(1);
+    bn *t = bn_alloc(1);
+
+    if (!a || !b || !t)
+        c->err = -ENOMEM;
+    else
+        c->err = bn_fib_pair(c->start, a, b, c->ctx);
+    for (long long k = c->start; !c->err && k <= c->end; k++) {
+        c->err = fib_check(c->ctx);
+        if (c->err)
+            break;
+        char *str = fib_bn_to_string(a, c->ctx);
+        if (IS_ERR(str)) {
+            c->err = PTR_ERR(str);
+            break;
+        }
+        c->strs[k - c->start] = str;
+        c->len += strlen(str) + 1;
+        if (atomic64_add_return(strlen(str) + 1, c->used) > c->size) {
+            c->err = -ENOSPC;
+            break;
+        }
+
+        bn_add(a, b, t);  // t = fib[k + 2]
+        bn_swap(a, b);
+        bn_swap(b, t);
+    }
+
+    bn_free(a);
+    bn_free(b);
+    bn_free(t);
+
+    if (atomic_dec_and_test(c->pending))
+        complete(c->done);
+}
+
+static long fib_range(struct file *file, struct fib_range __user *arg)
+{
+    struct fib_file *ff = file->private_data;
+    struct fib_range r;
+    struct fib_range_chunk *chunks;
+    unsigned int nchunks;
+    atomic64_t used = ATOMIC64_INIT(0);
+    atomic_t pending = ATOMIC_INIT(1);
+    DECLARE_COMPLETION_ONSTACK(done);
+    long ret = 0;
+
+    if (copy_from_user(&r, arg, sizeof(r)))
+        return -EFAULT;
+    if (r.start > r.end || r.end > READ_ONCE(range_end_max) ||
+        r.end - r.start >= READ_ONCE(range_max))
+        return -EINVAL;
+
+    // hopeless before computing anything
+    if (fib_range_bytes(r.start, r.end, false) > r.size) {
+        r.len = fib_range_bytes(r.start, r.end, true);
+        return put_user(r.len, &arg->len) ? -EFAULT : -ENOSPC;
+    }
+
+    struct fib_ctx ctx = {
+        .task = current,
+        .deadline = ff->budget_ns ? ktime_add_ns(ktime_get(), ff->budget_ns)
+                                  : 0,
+    };
+
+    long long count = r.end - r.start + 1;
+    nchunks = min_t(long long, count, num_online_cpus() * FIB_RANGE_SPLIT);
+    chunks = kcalloc(nchunks, sizeof(*chunks), GFP_KERNEL);
+    if (!chunks)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < nchunks; i++) {
+        struct fib_range_chunk *c = &chunks[i];
+        c->start = r.start + count * i / nchunks;
+        c->end = r.start + count * (i + 1) / nchunks - 1;
+        c->strs = kcalloc(c->end - c->start + 1, sizeof(char *), GFP_KERNEL);
+        if (!c->strs) {
+            nchunks = i;
+            ret = -ENOMEM;
+            break;
+        }
+        c->ctx = &ctx;
+        c->used = &used;
+        c->size = r.size;
+        c->pending = &pending;
+        c->done = &done;
+        atomic_inc(&pending);
+        INIT_WORK(&c->work, fib_range_work);
+        queue_work(system_unbound_wq, &c->work);
+    }
+
+    // a killed caller still has to wait for the chunks, but they see the
+    // fatal signal before their next number
+    if (!atomic_dec_and_test(&pending) && wait_for_completion_killable(&done))
+        wait_for_completion(&done);
+
+    r.len = 0;
+    for (unsigned int i = 0; i < nchunks; i++) {
+        r.len += chunks[i].len;
+        if (!ret || ret == -ENOSPC)
+            ret = chunks[i].err ? chunks[i].err : ret;
+    }
+
+    // the chunks stopped early, so only an upper bound of the need is known
+    if (ret == -ENOSPC)
+        r.len = fib_range_bytes(r.start, r.end, true);
+
+    char __user *p = u64_to_user_ptr(r.buf);
+    for (unsigned int i = 0; i < nchunks; i++) {
+        struct fib_range_chunk *c = &chunks[i];
+        for (long long k = 0; k <= c->end - c->start; k++) {
+            char *str = c->strs[k];
+            if (!ret && str) {
+                size_t len = strlen(str);
+                str[len] = '\n';
+                if (copy_to_user(p, str, len + 1))
+                    ret = -EFAULT;
+                p += len + 1;
+            }
+            kfree(str);
+        }
+        kfree(c->strs);
+    }
+    kfree(chunks);
+
+    if (ret && ret != -ENOSPC)
+        return ret;
+    if (put_user(r.len, &arg->len))
+        return -EFAULT;
+    return ret;
+}
+
+static long fib_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct fib_file *ff = file->private_data;
+
+    switch (cmd) {
+    case FIB_IOC_RANGE:
+        return fib_range(file, (struct fib_range __user *) arg);
+    case FIB_IOC_SET_BUDGET:
+        return get_user(ff->budget_ns, (u64 __user *) arg) ? -EFAULT : 0;
+    default:
+        return -ENOTTY;
+    }
 }
 
 static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
@@ -337,6 +1192,7 @@ const struct file_operations fib_fops = {
     .open = fib_open,
     .release = fib_release,
     .llseek = fib_device_lseek,
+    .unlocked_ioctl = fib_ioctl,
 };
 
 static int __init init_fib_dev(void)
@@ -344,6 +1200,28 @@ static int __init init_fib_dev(void)
     int rc = 0;
 
     mutex_init(&fib_mutex);
+    bn_kernel_init();
+
+    rc = fib_cp_build();
+    if (rc < 0) {
+        printk(KERN_ALERT "Failed to build the checkpoint table");
+        return rc;
+    }
+
+    if (fib_autotune)
+        fib_calibrate();
+
+    // Unbound and prefetch_workers at a time, at the default nice level:
+    // modules cannot set workqueue attributes, so with the default single
+    // worker prefetching takes at most one CPU from readers. Admins can
+    // lower its priority through the queue's sysfs nice attribute.
+    fib_prefetch_wq = alloc_workqueue("fibdrv_prefetch", WQ_UNBOUND | WQ_SYSFS,
+                                      max(prefetch_workers, 1U));
+    if (!fib_prefetch_wq) {
+        printk(KERN_ALERT "Failed to create the prefetch workqueue");
+        rc = -ENOMEM;
+        goto failed_wq;
+    }
 
     // Let's register the device
     // This will dynamically allocate the major number
@@ -353,7 +1231,7 @@ static int __init init_fib_dev(void)
         printk(KERN_ALERT
                "Failed to register the fibonacci char device. rc = %i",
                rc);
-        return rc;
+        goto failed_chrdev;
     }
 
     fib_cdev = cdev_alloc();
@@ -391,6 +1269,10 @@ failed_class_create:
     cdev_del(fib_cdev);
 failed_cdev:
     unregister_chrdev_region(fib_dev, 1);
+failed_chrdev:
+    destroy_workqueue(fib_prefetch_wq);
+failed_wq:
+    fib_cp_destroy();
     return rc;
 }
 
@@ -401,6 +1283,8 @@ static void __exit exit_fib_dev(void)
     class_destroy(fib_class);
     cdev_del(fib_cdev);
     unregister_chrdev_region(fib_dev, 1);
+    destroy_workqueue(fib_prefetch_wq);
+    fib_cp_destroy();
 }
 
 module_init(init_fib_dev);
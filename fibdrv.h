@@ -0,0 +1,30 @@
+#ifndef FIBDRV_H
+#define FIBDRV_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* FIB_IOC_RANGE: write fib[start..end] to buf as decimal numbers, one per
+ * line, and set len to the number of bytes written. If they do not fit in
+ * size, nothing is written, the ioctl fails with ENOSPC and len is set to a
+ * size that is large enough. end may not exceed the range_end_max module
+ * parameter.
+ */
+struct fib_range {
+    __u64 start;
+    __u64 end; /* inclusive */
+    __u64 buf; /* user pointer */
+    __u64 size;
+    __u64 len;
+};
+
+#define FIB_IOC_MAGIC 'f'
+#define FIB_IOC_RANGE _IOWR(FIB_IOC_MAGIC, 1, struct fib_range)
+
+/* FIB_IOC_SET_BUDGET: limit every later read and range on this file to the
+ * given number of nanoseconds (0 for no limit). A request that runs out of
+ * time fails with ETIME.
+ */
+#define FIB_IOC_SET_BUDGET _IOW(FIB_IOC_MAGIC, 2, __u64)
+
+#endif
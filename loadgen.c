@@ -0,0 +1,265 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FIB_DEV "/dev/fibonacci"
+#define MAX_SAMPLES (1 << 20) /* latency samples kept per thread */
+
+/* Multi-threaded load generator for /dev/fibonacci.
+ *
+ * For every thread count from 1 to -t (default: number of online CPUs),
+ * each thread opens the device and reads offsets drawn from the selected
+ * distribution for -s seconds. One line per step goes to stdout and to the
+ * output file:
+ *
+ *   threads ops/sec p50 p90 p99 p999   (latencies in ns)
+ *
+ * scaling.gp plots the file.
+ */
+
+enum dist { DIST_UNIFORM, DIST_ZIPF, DIST_SEQUENTIAL, DIST_FIXED };
+
+static const char *dev = FIB_DEV;
+static enum dist dist = DIST_UNIFORM;
+static int max_offset = 1000;
+static double zipf_s = 1.0;
+static double *zipf_cdf;
+static volatile int stop;
+
+struct worker {
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    long long ops;
+    long long nsamples;
+    long long *samples;
+};
+
+static inline long long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* xorshift64* */
+static inline uint64_t next_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+/* offsets are ranked by value, so small offsets are the hot ones */
+static void zipf_init(void)
+{
+    double sum = 0;
+    zipf_cdf = malloc(sizeof(double) * (max_offset + 1));
+    for (int i = 0; i <= max_offset; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i <= max_offset; i++)
+        zipf_cdf[i] /= sum;
+}
+
+static int zipf_pick(uint64_t *rng)
+{
+    double u = (next_rand(rng) >> 11) * (1.0 / (1ULL << 53));
+    int lo = 0, hi = max_offset;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int next_offset(struct worker *w, long long i)
+{
+    switch (dist) {
+    case DIST_ZIPF:
+        return zipf_pick(&w->rng);
+    case DIST_SEQUENTIAL:
+        return (w->id + i) % (max_offset + 1);
+    case DIST_FIXED:
+        return max_offset;
+    case DIST_UNIFORM:
+    default:
+        return next_rand(&w->rng) % (max_offset + 1);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    char buf[40960];
+
+    int fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open character device");
+        exit(1);
+    }
+
+    for (long long i = 0; !stop; i++) {
+        lseek(fd, next_offset(w, i), SEEK_SET);
+        long long start = now_ns();
+        if (read(fd, buf, sizeof(buf)) < 0) {
+            perror("read");
+            exit(1);
+        }
+        long long lat = now_ns() - start;
+
+        if (w->nsamples < MAX_SAMPLES)
+            w->samples[w->nsamples++] = lat;
+        w->ops++;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+static long long percentile(const long long *v, long long n, double p)
+{
+    if (!n)
+        return 0;
+    long long i = (long long) (p * (n - 1) + 0.5);
+    return v[i];
+}
+
+static void run_step(int nthreads, int seconds, FILE *output)
+{
+    struct worker *w = calloc(nthreads, sizeof(*w));
+
+    stop = 0;
+    for (int i = 0; i < nthreads; i++) {
+        w[i].id = i;
+        w[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        w[i].samples = malloc(sizeof(long long) * MAX_SAMPLES);
+        pthread_create(&w[i].tid, NULL, worker_main, &w[i]);
+    }
+
+    long long start = now_ns();
+    sleep(seconds);
+    stop = 1;
+
+    long long ops = 0, nsamples = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        ops += w[i].ops;
+        nsamples += w[i].nsamples;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    long long *all = malloc(sizeof(long long) * (nsamples + 1));
+    long long *p = all;
+    for (int i = 0; i < nthreads; i++) {
+        memcpy(p, w[i].samples, sizeof(long long) * w[i].nsamples);
+        p += w[i].nsamples;
+        free(w[i].samples);
+    }
+    qsort(all, nsamples, sizeof(long long), cmp_ll);
+
+    char line[256];
+    snprintf(line, sizeof(line), "%d %.0f %lld %lld %lld %lld\n", nthreads,
+             ops / elapsed, percentile(all, nsamples, 0.50),
+             percentile(all, nsamples, 0.90), percentile(all, nsamples, 0.99),
+             percentile(all, nsamples, 0.999));
+    fputs(line, stdout);
+    fputs(line, output);
+    fflush(output);
+
+    free(all);
+    free(w);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d uniform|zipf|sequential|fixed] [-n max_offset]\n"
+            "          [-z zipf_exponent] [-t max_threads] [-s seconds]\n"
+            "          [-f device] [-o output]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int seconds = 2;
+    const char *out = "loadgen.txt";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:z:t:s:f:o:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (!strcmp(optarg, "uniform"))
+                dist = DIST_UNIFORM;
+            else if (!strcmp(optarg, "zipf"))
+                dist = DIST_ZIPF;
+            else if (!strcmp(optarg, "sequential"))
+                dist = DIST_SEQUENTIAL;
+            else if (!strcmp(optarg, "fixed"))
+                dist = DIST_FIXED;
+            else
+                usage(argv[0]);
+            break;
+        case 'n':
+            max_offset = atoi(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'f':
+            dev = optarg;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (max_offset < 0 || max_threads < 1 || seconds < 1)
+        usage(argv[0]);
+
+    if (dist == DIST_ZIPF)
+        zipf_init();
+
+    FILE *output = fopen(out, "w");
+    if (!output) {
+        perror(out);
+        exit(1);
+    }
+
+    printf("# threads ops/sec p50 p90 p99 p999 (ns)\n");
+    for (int n = 1; n <= max_threads; n++)
+        run_step(n, seconds, output);
+
+    fclose(output);
+    free(zipf_cdf);
+    return 0;
+}
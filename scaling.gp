@@ -0,0 +1,11 @@
+reset
+set term png enhanced font 'Verdana,10'
+set output 'loadgen.png'
+set title "fibdrv throughput scaling"
+set xlabel "threads"
+set ylabel "ops/sec"
+set y2label "latency (ns)"
+set ytics nomirror
+set y2tics
+plot "loadgen.txt" using 1:2 with linespoints title "ops/sec", \
+     "loadgen.txt" using 1:5 axes x1y2 with linespoints title "p99 latency"